@@ -33,6 +33,8 @@
 #include <stdint.h>
 #include <linux/input.h>
 
+#include "rw_engine.h"
+
 #define ON_ERROR(str, args...)  \
 do {                            \
     perror("Error: "#str);      \
@@ -45,12 +47,6 @@ struct event_source {
 };
 typedef struct event_source event_source_t;
 
-struct event_record {
-    uint8_t ev_device_id;
-    struct  input_event event;
-};
-typedef struct event_record event_record_t;
-
 event_source_t* alloc_event_sources(const char* path, uint8_t* count);
 
 void free_event_sources(event_source_t *ev_source, uint8_t count);
@@ -0,0 +1,65 @@
+/*-
+ * Copyright (c) 2019 Atanas Filipov
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef REPLAYD_H
+#define REPLAYD_H
+
+#include <stdint.h>
+
+#include "rw_engine.h"
+
+#define REPLAYD_SOCKET  "/tmp/ev_replayd.sock"
+#define REPLAYD_MAGIC   0x52574a42  // "RWJB"
+
+enum replayd_job_type {
+    REPLAYD_JOB_FILE   = 1,     // Payload is the recording path
+    REPLAYD_JOB_INLINE = 2,     // Payload is an array of event records
+};
+
+// Move the cursor on base position before and after the replay
+#define REPLAYD_FLAG_HOME   0x01
+
+struct replayd_request {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t flags;
+    uint32_t length;            // Payload size in bytes
+    uint32_t catchup;           // rw_catchup_t policy of the job
+    uint32_t threshold_ms;      // Late threshold of the policy
+};
+typedef struct replayd_request replayd_request_t;
+
+struct replayd_reply {
+    int32_t  status;            // 0 on success, RW_PLAY_CANCELLED or -1
+    uint32_t job_id;
+    uint64_t queued_ns;         // Time spent in the daemon queue
+    rw_play_stats_t stats;
+};
+typedef struct replayd_reply replayd_reply_t;
+
+#endif
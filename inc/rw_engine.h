@@ -0,0 +1,174 @@
+/*-
+ * Copyright (c) 2019 Atanas Filipov
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef RW_ENGINE_H
+#define RW_ENGINE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/input.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Single recorded event, this is also the on-disk format of the recordings
+struct rw_record {
+    uint8_t ev_device_id;
+    struct  input_event event;
+};
+typedef struct rw_record rw_record_t;
+
+struct rw_frame {
+    uint64_t        deadline_ns;    // Offset from the first frame of the recording
+    uint32_t        first;          // Index of the first frame event in the arena
+    uint32_t        count;          // Number of events in the frame
+    uint8_t         ev_device_id;
+};
+typedef struct rw_frame rw_frame_t;
+
+// Preprocessed recording, ready to be written frame by frame, may be empty
+struct rw_arena {
+    struct input_event *events;
+    rw_frame_t         *frames;
+    uint32_t            num_events;
+    uint32_t            num_frames;
+};
+typedef struct rw_arena rw_arena_t;
+
+// Frames due longer than this are handled by the catch-up policy
+#define RW_LATE_THRESHOLD_MS    5
+
+// What the player does with the frames that missed their deadline
+enum rw_catchup {
+    RW_CATCHUP_BURST = 0,       // Write them as fast as possible
+    RW_CATCHUP_DROP,            // Skip the REL and single touch ABS frames
+    RW_CATCHUP_COALESCE,        // Merge the late REL frames in one
+    RW_CATCHUP_REBASE,          // Shift the rest of the timeline
+};
+typedef enum rw_catchup rw_catchup_t;
+
+struct rw_play_stats {
+    uint32_t frames;            // Frames written to the device
+    uint32_t events;            // Events written to the device
+    uint32_t late;              // Frames due longer than the late threshold
+    uint32_t dropped;           // Frames skipped by RW_CATCHUP_DROP
+    uint32_t merged;            // Frames folded by RW_CATCHUP_COALESCE
+    uint64_t duration_ns;       // Time from the first to the last frame write
+    uint64_t max_lateness_ns;   // Worst delay of a frame after its deadline
+    uint64_t rebased_ns;        // Total timeline shift by RW_CATCHUP_REBASE
+};
+typedef struct rw_play_stats rw_play_stats_t;
+
+typedef struct rw_capture rw_capture_t;
+typedef struct rw_player  rw_player_t;
+
+/*
+ * Called for every captured record. Return 0 to continue the capture,
+ * a positive value to stop it normally or a negative value on error.
+ */
+typedef int (*rw_capture_cb)(const rw_record_t *record, void *ctx);
+
+// Called after every frame written by the player
+typedef void (*rw_frame_cb)(const rw_frame_t *frame,
+                            const struct input_event *events, void *ctx);
+
+rw_arena_t* rw_arena_load(FILE *in_file);
+
+rw_arena_t* rw_arena_alloc(const rw_record_t *records, uint32_t count);
+
+void rw_arena_free(rw_arena_t *arena);
+
+/*
+ * The engine never prints, functions returning a handle give NULL and
+ * the others -1 on failure, with errno set by the failing system call.
+ */
+
+/*
+ * Capture sessions, every node in the "path" folder (/dev/input when NULL)
+ * is a source and its index is stored as ev_device_id in the records.
+ */
+rw_capture_t* rw_capture_open(const char *path);
+
+void rw_capture_close(rw_capture_t *cap);
+
+// Capture in the calling thread, until cancelled or stopped by the callback
+int rw_capture_run(rw_capture_t *cap, rw_capture_cb cb, void *ctx);
+
+// Capture in a background thread, to the callback or to a caller buffer
+int rw_capture_start(rw_capture_t *cap, rw_capture_cb cb, void *ctx);
+
+int rw_capture_start_buffer(rw_capture_t *cap, rw_record_t *buffer, size_t size);
+
+// Stop the background capture, "count" receives the number of records
+int rw_capture_stop(rw_capture_t *cap, size_t *count);
+
+// Async-signal-safe, interrupts the running capture
+void rw_capture_cancel(rw_capture_t *cap);
+
+/*
+ * Player sessions, each one owns a virtual uinput device created on
+ * "node" (/dev/uinput when NULL) for its whole lifetime.
+ */
+rw_player_t* rw_player_open(const char *node);
+
+void rw_player_close(rw_player_t *player);
+
+void rw_player_set_frame_cb(rw_player_t *player, rw_frame_cb cb, void *ctx);
+
+// Frames later than "threshold_ms" are handled according to "policy",
+// drop and coalesce need a non zero threshold
+int rw_player_set_catchup(rw_player_t *player, rw_catchup_t policy, uint32_t threshold_ms);
+
+// Write a batch of events at once, without any scheduling
+int rw_player_inject(rw_player_t *player, const struct input_event *events, size_t count);
+
+// rw_player_play result when rw_player_cancel stopped it before the end
+#define RW_PLAY_CANCELLED   1
+
+/*
+ * Replay with the original timing, the first frame is written immediately.
+ * Returns 0 when all frames were handled, RW_PLAY_CANCELLED or -1.
+ */
+int rw_player_play(rw_player_t *player, const rw_arena_t *arena, rw_play_stats_t *stats);
+
+int rw_player_play_records(rw_player_t *player, const rw_record_t *records,
+                           uint32_t count, rw_play_stats_t *stats);
+
+// Move the cursor to the lower left corner
+int rw_player_home(rw_player_t *player);
+
+// Async-signal-safe, interrupts the running replay
+void rw_player_cancel(rw_player_t *player);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,101 @@
+/*-
+ * Copyright (c) 2019 Atanas Filipov
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/input.h>
+
+#define TRACE_MAGIC     "RWTR"
+#define TRACE_VERSION   2
+
+enum trace_kind {
+    TRACE_CAPTURE = 1,          // Event read from a source, arg is event time in usec
+    TRACE_REPLAY,               // Event written to uinput, arg is lateness in nsec
+    TRACE_DROP,                 // Frame skipped by the player, value is its events
+    TRACE_MERGE,                // Frame coalesced, value is the merged frames
+    TRACE_LOST,                 // Ring overflow, value is the lost records
+};
+
+// Fixed size binary record, written as is to the trace files
+struct rw_trace_record {
+    uint64_t ts_ns;             // CLOCK_MONOTONIC time of the trace point
+    int64_t  arg;
+    int32_t  value;
+    uint16_t type;
+    uint16_t code;
+    uint8_t  kind;
+    uint8_t  ev_device_id;
+    uint16_t reserved;
+    uint32_t thread;            // Ring index of the producer thread
+};
+typedef struct rw_trace_record rw_trace_record_t;
+
+struct rw_trace_header {
+    char     magic[4];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+};
+typedef struct rw_trace_header rw_trace_header_t;
+
+extern int rw_trace_enabled;
+
+/*
+ * Start the consumer thread, which drains the per-thread rings to "out",
+ * either formatted as text or as binary records behind a trace_header.
+ */
+int rw_trace_start(FILE *out, bool binary);
+
+// Start a binary trace to a new "path" file, closed by rw_trace_stop
+int rw_trace_start_file(const char *path);
+
+// Drain the remaining records and stop the consumer thread
+void rw_trace_stop(void);
+
+// Records of the rings created from now on, rounded up to a power of two
+void rw_trace_set_ring_size(uint32_t records);
+
+void rw_trace_emit(uint8_t kind, uint8_t ev_device_id, const struct input_event *event,
+                   int64_t arg);
+
+void rw_trace_format(FILE *out, const rw_trace_record_t *record);
+
+// Hot path entry, costs a single load while tracing is off
+static inline void rw_trace_point(uint8_t kind, uint8_t ev_device_id,
+                                  const struct input_event *event, int64_t arg)
+{
+    if (__atomic_load_n(&rw_trace_enabled, __ATOMIC_RELAXED)) {
+        rw_trace_emit(kind, ev_device_id, event, arg);
+    }
+}
+
+#endif
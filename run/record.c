@@ -30,80 +30,42 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
-#include <poll.h>
 #include <signal.h>
 #include <unistd.h>
-#include <dirent.h>
 #include <err.h>
-#include <errno.h>
 #include <getopt.h>
-#include <sys/stat.h>
 #include <linux/input.h>
-#include <linux/uinput.h>
-#include <linux/limits.h>
 
 #include "common.h"
+#include "trace.h"
 
 static const char *in_folder = "/dev/input";
 static const char *out_fname = "/tmp/events.bin";
 static const char *uinput_node = "/dev/uinput";
 
 static bool show_info = false;
-static bool loop = true;
-static event_source_t *ev_source;
+static const char *trace_fname = NULL;
+static rw_capture_t *capture;
 
-static int prepare(int ufd)
+static int prepare(void)
 {
-    if (acquire_uinput(ufd)) {
+    rw_player_t *player;
+
+    player = rw_player_open(uinput_node);
+    if (!player) {
         printf("Acquire output devices failed\n");
         return -1;
     }
 
     sleep(1);
 
-    if (set_position(ufd)) {
+    if (rw_player_home(player)) {
         printf("Can't setup cursor position\n");
+        rw_player_close(player);
         return -1;
     }
 
-    if (release_uinput(ufd)) {
-        printf("Release output device failed\n");
-        return -1;
-    }
-
-    return 0;
-}
-
-static int acquire(struct pollfd *fds, uint8_t count)
-{
-    char buffer[PATH_MAX];
-
-    for(uint8_t i = 0; i < count; i++) {
-        sprintf(buffer, "%s/%s", in_folder, ev_source[i].ev_device_name);
-        fds[i].events = POLLIN;
-        fds[i].fd = open(buffer, O_RDONLY | O_NDELAY);
-        if(fds[i].fd < 0) {
-            printf("Can't open input device node %s\n", ev_source[i].ev_device_name);
-            return -1;
-        }
-    }
-
-    return 0;
-}
-
-static int release(struct pollfd *fds, uint8_t count)
-{
-    for (uint8_t i = 0; i < count; i++) {
-        if (close(fds[i].fd)) {
-            printf("Can't close input device node %s\n", ev_source[i].ev_device_name);
-            return -1;
-        }
-    }
-
-    if (ev_source != NULL && count > 0) {
-        free_event_sources(ev_source, count);
-    }
+    rw_player_close(player);
 
     return 0;
 }
@@ -111,59 +73,30 @@ static int release(struct pollfd *fds, uint8_t count)
 static void sig_handler(int signo)
 {
     if (signo == SIGINT) {
-        loop = false;
+        rw_capture_cancel(capture);
     }
 }
 
-static int record(struct pollfd *fds, uint8_t count, FILE *ohandle)
+static int record_event(const rw_record_t *record, void *ctx)
 {
-    event_record_t record;
-    bool skip_write = false;
-    int size;
-
-    while(loop) {
-
-        if(poll(fds, count, -1) < 0) {
-            return -1;
+    FILE *ohandle = ctx;
+    static bool skip_write = false;
+
+    // If CTRL + key pressed, wait until CTRL key released
+    if (record->event.type == EV_KEY) {
+        if (record->event.code == KEY_LEFTCTRL || record->event.code == KEY_RIGHTCTRL) {
+            if (record->event.value) {
+                skip_write = true;
+            } else {
+                skip_write = false;
+            }
         }
+    }
 
-        for(uint8_t i = 0; i < count; i++) {
-            if(fds[i].revents & POLLIN) {
-                memset(&record, 0, sizeof(record));
-                // Data available
-                size = read(fds[i].fd, &record.event, sizeof(record.event));
-                if(size != sizeof(record.event)) {
-#ifdef DEBUG
-                    printf("Unexpected event size %d\n", size);
-#endif
-                    continue;
-                }
-
-                // If CTRL + key pressed, wait until CTRL key released
-                if (record.event.type == EV_KEY) {
-                    if (record.event.code == KEY_LEFTCTRL || record.event.code == KEY_RIGHTCTRL) {
-                        if (record.event.value) {
-                            skip_write = true;
-                        } else {
-                            skip_write = false;
-                        }
-                    }
-                }
-
-                if (!skip_write) {
-                    record.ev_device_id = i;
-                    if(fwrite(&record, 1, sizeof(record), ohandle) != sizeof(record)) {
-                        printf("Cannot write output record\n");
-                        return -1;
-                    }
-                }
-
-                if (show_info) {
-                    printf("input %d, time %ld.%06ld, type %d, code %d, value %d\n",
-                           i, record.event.time.tv_sec, record.event.time.tv_usec,
-                           record.event.type, record.event.code, record.event.value);
-                }
-            }
+    if (!skip_write) {
+        if(fwrite(record, 1, sizeof(*record), ohandle) != sizeof(*record)) {
+            printf("Cannot write output record\n");
+            return -1;
         }
     }
 
@@ -180,20 +113,19 @@ static void show_help(void)
     printf("                    the default value is: %s\n", out_fname);
     printf("      -n        : Skip mouse position setup\n");
     printf("                    the default value is false\n");
-    printf("      -v        : Verbose output\n");
+    printf("      -v        : Verbose output, traced events on stdout\n");
     printf("                    the default value is false\n");
+    printf("      -T trace  : Binary trace file, see ev_tracedump\n");
+    printf("                    not used by default\n");
 }
 
 int main(int argc, char **argv)
 {
     int opt;
     FILE *out_hdl;
-    struct pollfd *in_fds = NULL;
-    static uint8_t num_nodes = 0;
     bool move_to = true;
-    int ufd;
 
-    while ((opt = getopt(argc, argv, "h?vnd:f:")) != -1) {
+    while ((opt = getopt(argc, argv, "h?vnd:f:T:")) != -1) {
         switch (opt) {
         case 'h':
         case '?':
@@ -211,27 +143,20 @@ int main(int argc, char **argv)
         case 'v':
             show_info = true;
             break;
+        case 'T':
+            trace_fname = optarg;
+            break;
         default:
             show_help();
             ON_ERROR("Unknown option");
         }
     }
 
-    if (signal(SIGINT, sig_handler) == SIG_ERR) {
-        ON_ERROR("Can't catch SIGINT");
-    }
-
     // Move the mouse cursor to lower left corner before start of recording
     if (move_to) {
-        ufd = open(uinput_node, O_WRONLY | O_NONBLOCK);
-        if (ufd < 0) {
-            ON_ERROR("Open uinput device failed");
-        }
-
-        if (prepare(ufd)) {
+        if (prepare()) {
             ON_ERROR("Can't setup base position");
         }
-        close(ufd);
     }
 
     out_hdl = fopen(out_fname, "w");
@@ -239,32 +164,34 @@ int main(int argc, char **argv)
         ON_ERROR("Can't create output file");
     }
 
-    ev_source = alloc_event_sources(in_folder, &num_nodes);
-    if (!ev_source) {
-            ON_ERROR("Can't allocate event nodes");
+    capture = rw_capture_open(in_folder);
+    if (!capture) {
+        ON_ERROR("Acquire input devices failed");
     }
 
-    in_fds = malloc(sizeof(struct pollfd) * num_nodes);
-    if (!in_fds) {
-        ON_ERROR("Can't allocate resources");
+    if (signal(SIGINT, sig_handler) == SIG_ERR) {
+        ON_ERROR("Can't catch SIGINT");
     }
 
-    if (acquire(in_fds, num_nodes)) {
-        ON_ERROR("Acquire input devices failed");
+    // The verbose output is traced, not printed from the hot loops
+    if (trace_fname) {
+        if (rw_trace_start_file(trace_fname)) {
+            ON_ERROR("Can't create trace file");
+        }
+    } else if (show_info) {
+        if (rw_trace_start(stdout, false)) {
+            ON_ERROR("Can't start tracing");
+        }
     }
 
     printf("Recording started, use CTRL+C to stop it\n");
-    if (record(in_fds, num_nodes, out_hdl)) {
-        if (errno != EINTR) {
-            ON_ERROR("Recording failed");
-        }
+    if (rw_capture_run(capture, record_event, out_hdl)) {
+        ON_ERROR("Recording failed");
     }
 
-    if (release(in_fds, num_nodes)) {
-        ON_ERROR("Resources release failed");
-    }
+    rw_trace_stop();
 
-    free(in_fds);
+    rw_capture_close(capture);
 
     if (fclose(out_hdl)) {
         ON_ERROR("Can't close output file");
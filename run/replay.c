@@ -37,90 +37,303 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <linux/input.h>
 #include <linux/uinput.h>
 #include <linux/limits.h>
 
 #include "common.h"
+#include "replayd.h"
+#include "trace.h"
 
 static const char *in_records = "/tmp/events.bin";
 static const char *uinput_node = "/dev/uinput";
+static const char *socket_path = NULL;
 
 static bool show_info = false;
-static bool loop = true;
+static const char *trace_fname = NULL;
+static volatile sig_atomic_t loop = true;
+static rw_player_t *player;
+
+// The recording is preloaded once and replayed "iterations" times
+static unsigned long iterations = 1;
+static unsigned long duration = 0;
+static unsigned long gap_min = 0;
+static unsigned long gap_max = 0;
+
+// Handling of the frames which missed their deadline
+static rw_catchup_t catchup = RW_CATCHUP_BURST;
+static uint32_t threshold_ms = RW_LATE_THRESHOLD_MS;
+
+static const char *catchup_names[] = {
+    [RW_CATCHUP_BURST]    = "burst",
+    [RW_CATCHUP_DROP]     = "drop",
+    [RW_CATCHUP_COALESCE] = "coalesce",
+    [RW_CATCHUP_REBASE]   = "rebase",
+};
 
 static void sig_handler(int signo)
 {
     if (signo == SIGINT) {
         loop = 0;
+        rw_player_cancel(player);
     }
 }
 
-static int replay(int fd, FILE *in_file)
+static int replay_loop(const rw_arena_t *arena, bool move_to)
 {
-    event_record_t record;
-    struct timeval tdiff;
-    struct timeval now, tevent, tsleep;
+    struct timespec now, finish, gap;
+    rw_play_stats_t stats;
+    int ret;
 
-    timerclear(&tdiff);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    finish.tv_sec += duration;
 
-    while (loop) {
+    for (unsigned long n = 0; loop && (!iterations || n < iterations); n++) {
+        if (duration) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec > finish.tv_sec ||
+                (now.tv_sec == finish.tv_sec && now.tv_nsec >= finish.tv_nsec)) {
+                break;
+            }
+        }
 
-        if (fread(&record, 1, sizeof(record), in_file) != sizeof(record)) {
-            if (feof(in_file)) {
-                return 0;
+        if (n && gap_max) {
+            unsigned long msec = gap_min;
+            if (gap_max > gap_min) {
+                msec += random() % (gap_max - gap_min + 1);
             }
+            gap.tv_sec = msec / 1000;
+            gap.tv_nsec = (msec % 1000) * 1000000L;
+            nanosleep(&gap, NULL);
+        }
 
+        ret = rw_player_play(player, arena, &stats);
+        if (ret < 0) {
             return -1;
         }
-
-        gettimeofday(&now, NULL);
-        if (!timerisset(&tdiff)) {
-            timersub(&now, &record.event.time, &tdiff);
+        if (ret == RW_PLAY_CANCELLED) {
+            break;
         }
 
-        timeradd(&record.event.time, &tdiff, &tevent);
-        timersub(&tevent, &now, &tsleep);
-        if (tsleep.tv_sec || tsleep.tv_usec) {
-            select(0, NULL, NULL, NULL, &tsleep);
+        // Every iteration starts from the same cursor position
+        if (move_to && rw_player_home(player)) {
+            return -1;
         }
 
-        record.event.time = tevent;
-        if (write(fd, &record.event, sizeof(record.event)) != sizeof(record.event)) {
-            ON_ERROR("Can't propagate event");
+        if (show_info) {
+            printf("iteration %lu, frames %u, max lateness %lu us, "
+                   "late %u, dropped %u, merged %u\n", n + 1, stats.frames,
+                   (unsigned long)(stats.max_lateness_ns / 1000),
+                   stats.late, stats.dropped, stats.merged);
         }
+    }
 
-        if (show_info) {
-            printf("input %d, time %ld.%06ld, type %d, code %d, value %d\n",
-                   record.ev_device_id, record.event.time.tv_sec,
-                   record.event.time.tv_usec, record.event.type,
-                   record.event.code, record.event.value);
+    return 0;
+}
+
+static int parse_gap(const char *arg)
+{
+    char *end;
+
+    gap_min = strtoul(arg, &end, 10);
+    if (*end == ':') {
+        gap_max = strtoul(end + 1, &end, 10);
+    } else {
+        gap_max = gap_min;
+    }
+
+    if (*end != '\0' || gap_max < gap_min) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_full(int fd, const void *buffer, size_t size)
+{
+    const uint8_t *ptr = buffer;
+    ssize_t ret;
+
+    while (size) {
+        ret = write(fd, ptr, size);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
         }
-    };
+        ptr += ret;
+        size -= ret;
+    }
 
     return 0;
 }
 
+static void* load_payload(bool send_inline, uint32_t *length)
+{
+    char *payload;
+    FILE *in_file;
+    long size;
+
+    if (!send_inline) {
+        // The daemon may run in another working directory
+        payload = realpath(in_records, NULL);
+        if (payload) {
+            *length = strlen(payload);
+        }
+        return payload;
+    }
+
+    in_file = fopen(in_records, "r");
+    if (!in_file) {
+        return NULL;
+    }
+
+    if (fseek(in_file, 0, SEEK_END) || (size = ftell(in_file)) < 0) {
+        fclose(in_file);
+        return NULL;
+    }
+    rewind(in_file);
+
+    // An empty recording is sent as an empty payload
+    payload = malloc(size ? size : 1);
+    if (payload && fread(payload, 1, size, in_file) != (size_t)size) {
+        free(payload);
+        payload = NULL;
+    }
+    fclose(in_file);
+
+    *length = size;
+
+    return payload;
+}
+
+static int submit_job(bool send_inline, bool move_to)
+{
+    struct sockaddr_un addr;
+    replayd_request_t request;
+    replayd_reply_t reply;
+    void *payload;
+    int fd, ret = -1;
+
+    memset(&request, 0, sizeof(request));
+    request.magic = REPLAYD_MAGIC;
+    request.type = send_inline ? REPLAYD_JOB_INLINE : REPLAYD_JOB_FILE;
+    request.flags = move_to ? REPLAYD_FLAG_HOME : 0;
+    request.catchup = catchup;
+    request.threshold_ms = threshold_ms;
+
+    payload = load_payload(send_inline, &request.length);
+    if (!payload) {
+        printf("Can't read input file\n");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        free(payload);
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        printf("Can't connect to %s\n", socket_path);
+    } else if (write_full(fd, &request, sizeof(request)) ||
+               write_full(fd, payload, request.length)) {
+        printf("Can't send replay job\n");
+    } else if (read(fd, &reply, sizeof(reply)) != sizeof(reply)) {
+        printf("No reply from the replay daemon\n");
+    } else {
+        ret = reply.status;
+        printf("job %u, status %d, frames %u, events %u, queued %lu us, "
+               "duration %lu us, max lateness %lu us, "
+               "late %u, dropped %u, merged %u\n",
+               reply.job_id, reply.status, reply.stats.frames, reply.stats.events,
+               (unsigned long)(reply.queued_ns / 1000),
+               (unsigned long)(reply.stats.duration_ns / 1000),
+               (unsigned long)(reply.stats.max_lateness_ns / 1000),
+               reply.stats.late, reply.stats.dropped, reply.stats.merged);
+    }
+
+    close(fd);
+    free(payload);
+
+    return ret;
+}
+
+static int parse_catchup(const char *arg)
+{
+    const char *sep = strchr(arg, ':');
+    size_t len = sep ? (size_t)(sep - arg) : strlen(arg);
+    char *end;
+
+    for (size_t i = 0; i < sizeof(catchup_names) / sizeof(catchup_names[0]); i++) {
+        if (strlen(catchup_names[i]) == len && !strncmp(arg, catchup_names[i], len)) {
+            catchup = i;
+            if (sep) {
+                threshold_ms = strtoul(sep + 1, &end, 10);
+                if (*end != '\0') {
+                    return -1;
+                }
+            }
+            // Drop and coalesce would discard every frame without a threshold
+            if (!threshold_ms && (catchup == RW_CATCHUP_DROP || catchup == RW_CATCHUP_COALESCE)) {
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
 static void show_help(void)
 {
     printf("Usage: ev_replay <options>\n");
     printf("Where -h print help\n");
     printf("      -f input : The input file name\n");
     printf("                   the default value is: %s\n", in_records);
+    printf("      -l count : Replay the input count times, the default is 1,\n");
+    printf("                   0 means until CTRL+C or the -t limit\n");
+    printf("      -t secs  : Replay the input in a loop,\n");
+    printf("                   no new iteration is started after secs\n");
+    printf("      -g min[:max] : Gap between loop iterations in msec,\n");
+    printf("                   randomized in the range when max is given\n");
+    printf("      -s socket : Submit the input as a job to ev_replayd,\n");
+    printf("                   the loop options are not used, e.g. %s\n", REPLAYD_SOCKET);
+    printf("      -i       : Send the records inline instead of the path\n");
+    printf("                   the default value is false\n");
+    printf("      -c policy[:msec] : Handling of frames later than msec,\n");
+    printf("                   burst, drop, coalesce or rebase,\n");
+    printf("                   drop and coalesce need msec > 0\n");
+    printf("                   the default value is: %s:%d\n",
+           catchup_names[RW_CATCHUP_BURST], RW_LATE_THRESHOLD_MS);
     printf("      -n       : Skip mouse position setup\n");
     printf("                   the default value is false\n");
-    printf("      -v       : Verbose output\n");
+    printf("      -v       : Verbose output, traced events on stdout\n");
     printf("                   the default value is false\n");
+    printf("      -T trace : Binary trace file, see ev_tracedump\n");
+    printf("                   not used by default\n");
 }
 
 int main(int argc, char **argv)
 {
     int opt;
-    int fd;
     FILE *in_file;
     bool move_to = true;
+    bool count_set = false;
+    bool send_inline = false;
+    char *end;
+    rw_arena_t *arena = NULL;
 
-    while ((opt = getopt(argc, argv, "h?nvf:")) != -1) {
+    while ((opt = getopt(argc, argv, "h?nvif:l:t:g:s:c:T:")) != -1) {
         switch (opt) {
             case 'h':
             case '?':
@@ -129,20 +342,65 @@ int main(int argc, char **argv)
             case 'f':
                 in_records = optarg;
                 break;
+            case 'l':
+                iterations = strtoul(optarg, &end, 10);
+                if (*end != '\0') {
+                    show_help();
+                    exit(EXIT_FAILURE);
+                }
+                count_set = true;
+                break;
+            case 't':
+                duration = strtoul(optarg, &end, 10);
+                if (*end != '\0') {
+                    show_help();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'g':
+                if (parse_gap(optarg)) {
+                    show_help();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                socket_path = optarg;
+                break;
+            case 'i':
+                send_inline = true;
+                break;
+            case 'c':
+                if (parse_catchup(optarg)) {
+                    show_help();
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'n':
                 move_to = false;
                 break;
             case 'v':
                 show_info = true;
                 break;
+            case 'T':
+                trace_fname = optarg;
+                break;
             default:
                 show_help();
                 exit(EXIT_SUCCESS);
         }
     }
 
-    if (signal(SIGINT, sig_handler) == SIG_ERR) {
-        ON_ERROR("Can't catch SIGINT");
+    // A duration without count loops until the time limit
+    if (duration && !count_set) {
+        iterations = 0;
+    }
+
+    // Replay on the warm device of ev_replayd
+    if (socket_path) {
+        if (submit_job(send_inline, move_to)) {
+            ON_ERROR("Replay job failed");
+        }
+        return EXIT_SUCCESS;
     }
 
     in_file = fopen(in_records, "r");
@@ -150,39 +408,54 @@ int main(int argc, char **argv)
         ON_ERROR("Can't open input file");
     }
 
-    fd = open(uinput_node, O_WRONLY | O_NONBLOCK);
-    if (fd < 0) {
-        ON_ERROR("Open uinput device failed");
+    // Parse and group the records in frames before the device is created
+    arena = rw_arena_load(in_file);
+    if (!arena) {
+        ON_ERROR("Can't preload input file");
     }
+    fclose(in_file);
+    srandom(time(NULL));
 
-    if (acquire_uinput(fd)) {
+    player = rw_player_open(uinput_node);
+    if (!player) {
         ON_ERROR("Acquire output devices failed");
     }
 
-    // Move mouse on base position
-    if (move_to) {
-        sleep(1);
-        if (set_position(fd)) {
-            ON_ERROR("Can't setup cursor position");
+    if (rw_player_set_catchup(player, catchup, threshold_ms)) {
+        ON_ERROR("Invalid catch-up policy");
+    }
+
+    // The verbose output is traced, not printed from the hot loops
+    if (trace_fname) {
+        if (rw_trace_start_file(trace_fname)) {
+            ON_ERROR("Can't create trace file");
+        }
+    } else if (show_info) {
+        if (rw_trace_start(stdout, false)) {
+            ON_ERROR("Can't start tracing");
         }
     }
 
-    if (replay(fd, in_file)) {
-        ON_ERROR("Records replay failed");
+    if (signal(SIGINT, sig_handler) == SIG_ERR) {
+        ON_ERROR("Can't catch SIGINT");
     }
 
     // Move mouse on base position
     if (move_to) {
-        if (set_position(fd)) {
+        sleep(1);
+        if (rw_player_home(player)) {
             ON_ERROR("Can't setup cursor position");
         }
     }
 
-    if (release_uinput(fd)) {
-        ON_ERROR("Release output device failed");
+    if (replay_loop(arena, move_to)) {
+        ON_ERROR("Records replay failed");
     }
 
-    close(fd);
+    rw_trace_stop();
+
+    rw_player_close(player);
+    rw_arena_free(arena);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,575 @@
+/*-
+ * Copyright (c) 2019 Atanas Filipov
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/limits.h>
+
+#include "common.h"
+#include "replayd.h"
+#include "trace.h"
+
+// Largest inline recording accepted from a client
+#define MAX_INLINE_SIZE (64 * 1024 * 1024)
+
+// Time for a client to send the whole request, including the payload
+#define REQUEST_TIMEOUT_SEC 5
+
+// Connections whose requests are read at the same time
+#define MAX_PENDING 16
+
+struct replay_job {
+    struct replay_job *next;
+    int              fd;        // Client connection, receives the reply
+    uint32_t         id;
+    uint32_t         flags;
+    rw_catchup_t     catchup;
+    uint32_t         threshold_ms;
+    struct timespec  queued;
+    rw_arena_t      *arena;
+};
+typedef struct replay_job replay_job_t;
+
+// Connection whose request is still being read by the main thread
+struct pending_request {
+    int               fd;
+    uint32_t          id;
+    struct timespec   deadline;
+    replayd_request_t request;
+    size_t            received;     // Bytes of the request header
+    uint8_t          *payload;
+    size_t            loaded;       // Bytes of the payload
+};
+typedef struct pending_request pending_request_t;
+
+static const char *socket_path = REPLAYD_SOCKET;
+static const char *uinput_node = "/dev/uinput";
+
+static bool show_info = false;
+static const char *trace_fname = NULL;
+static volatile sig_atomic_t loop = true;
+static rw_player_t *player;
+static int listen_fd = -1;
+
+// Job queue, filled by the main thread and drained by the player thread
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static replay_job_t *queue_head;
+static replay_job_t *queue_tail;
+static bool queue_closed = false;
+
+// Requests being read, a stalled client only delays its own job
+static pending_request_t pending[MAX_PENDING];
+static int num_pending;
+
+static void sig_handler(int signo)
+{
+    if (signo == SIGINT || signo == SIGTERM) {
+        loop = false;
+        rw_player_cancel(player);
+        // Wake up the main thread blocked in poll
+        shutdown(listen_fd, SHUT_RDWR);
+    }
+}
+
+static void send_reply(replay_job_t *job, int status, uint64_t queued_ns,
+                       const rw_play_stats_t *stats)
+{
+    replayd_reply_t reply;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.status = status;
+    reply.job_id = job->id;
+    reply.queued_ns = queued_ns;
+    if (stats != NULL) {
+        reply.stats = *stats;
+    }
+
+    if (write(job->fd, &reply, sizeof(reply)) != sizeof(reply)) {
+        printf("Can't send reply of job %u\n", job->id);
+    }
+}
+
+static void free_job(replay_job_t *job)
+{
+    close(job->fd);
+    rw_arena_free(job->arena);
+    free(job);
+}
+
+static rw_arena_t* load_file_job(const char *path)
+{
+    rw_arena_t *arena;
+    FILE *in_file;
+
+    in_file = fopen(path, "r");
+    if (!in_file) {
+        printf("Can't open input file %s\n", path);
+        return NULL;
+    }
+
+    arena = rw_arena_load(in_file);
+    fclose(in_file);
+
+    return arena;
+}
+
+static bool check_request(const replayd_request_t *request)
+{
+    if (request->magic != REPLAYD_MAGIC) {
+        printf("Invalid request\n");
+        return false;
+    }
+
+    if (request->catchup > RW_CATCHUP_REBASE || (!request->threshold_ms &&
+        (request->catchup == RW_CATCHUP_DROP || request->catchup == RW_CATCHUP_COALESCE))) {
+        printf("Invalid catch-up policy\n");
+        return false;
+    }
+
+    switch (request->type) {
+        case REPLAYD_JOB_FILE:
+            return request->length && request->length < PATH_MAX;
+        case REPLAYD_JOB_INLINE:
+            // An empty recording gives an empty arena, the job is a no-op
+            return request->length <= MAX_INLINE_SIZE &&
+                   !(request->length % sizeof(rw_record_t));
+        default:
+            printf("Invalid request\n");
+            return false;
+    }
+}
+
+/*
+ * Read what the client has sent so far, the socket is readable so this does
+ * not block. Returns 1 when the whole request is read, 0 when more is
+ * expected and -1 on errors.
+ */
+static int read_request(pending_request_t *req)
+{
+    uint8_t *header = (uint8_t *)&req->request;
+    ssize_t ret;
+
+    if (req->received < sizeof(req->request)) {
+        ret = read(req->fd, header + req->received, sizeof(req->request) - req->received);
+    } else {
+        ret = read(req->fd, req->payload + req->loaded, req->request.length - req->loaded);
+    }
+
+    if (ret < 0 && errno == EINTR) {
+        return 0;
+    }
+    if (ret <= 0) {
+        return -1;
+    }
+
+    if (req->received < sizeof(req->request)) {
+        req->received += ret;
+        if (req->received < sizeof(req->request)) {
+            return 0;
+        }
+        if (!check_request(&req->request)) {
+            return -1;
+        }
+        // One more byte terminates the path of a file job
+        req->payload = malloc(req->request.length + 1);
+        if (!req->payload) {
+            return -1;
+        }
+    } else {
+        req->loaded += ret;
+    }
+
+    return req->loaded == req->request.length;
+}
+
+// Parse the request before queueing, the player thread only replays
+static replay_job_t* create_job(pending_request_t *req)
+{
+    replay_job_t *job;
+
+    job = calloc(1, sizeof(*job));
+    if (!job) {
+        return NULL;
+    }
+
+    job->fd = req->fd;
+    job->id = req->id;
+    job->flags = req->request.flags;
+    job->catchup = req->request.catchup;
+    job->threshold_ms = req->request.threshold_ms;
+
+    switch (req->request.type) {
+        case REPLAYD_JOB_FILE:
+            req->payload[req->request.length] = '\0';
+            job->arena = load_file_job((const char *)req->payload);
+            break;
+        case REPLAYD_JOB_INLINE:
+            job->arena = rw_arena_alloc((const rw_record_t *)req->payload,
+                                        req->request.length / sizeof(rw_record_t));
+            break;
+        default:
+            break;
+    }
+
+    if (!job->arena) {
+        send_reply(job, -1, 0, NULL);
+        free(job);
+        return NULL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &job->queued);
+
+    return job;
+}
+
+static void add_pending(int fd, uint32_t id)
+{
+    pending_request_t *req = &pending[num_pending++];
+
+    memset(req, 0, sizeof(*req));
+    req->fd = fd;
+    req->id = id;
+    clock_gettime(CLOCK_MONOTONIC, &req->deadline);
+    req->deadline.tv_sec += REQUEST_TIMEOUT_SEC;
+}
+
+// The connection is closed by the caller, unless it was passed to a job
+static void remove_pending(int i)
+{
+    free(pending[i].payload);
+    pending[i] = pending[--num_pending];
+}
+
+static void push_job(replay_job_t *job)
+{
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail) {
+        queue_tail->next = job;
+    } else {
+        queue_head = job;
+    }
+    queue_tail = job;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static replay_job_t* pop_job(void)
+{
+    replay_job_t *job;
+
+    pthread_mutex_lock(&queue_lock);
+    while (!queue_head && !queue_closed) {
+        pthread_cond_wait(&queue_cond, &queue_lock);
+    }
+    job = queue_head;
+    if (job) {
+        queue_head = job->next;
+        if (!queue_head) {
+            queue_tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    return job;
+}
+
+static void close_queue(void)
+{
+    pthread_mutex_lock(&queue_lock);
+    queue_closed = true;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static void* player_thread(void *arg)
+{
+    replay_job_t *job;
+    rw_play_stats_t stats;
+    struct timespec start;
+    uint64_t queued_ns;
+    int status;
+
+    (void)arg;
+
+    while ((job = pop_job()) != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        queued_ns = (uint64_t)(start.tv_sec - job->queued.tv_sec) * 1000000000ULL +
+                    start.tv_nsec - job->queued.tv_nsec;
+
+        // Jobs still queued on shutdown are rejected
+        status = loop ? 0 : -1;
+        memset(&stats, 0, sizeof(stats));
+
+        if (!status && (job->flags & REPLAYD_FLAG_HOME) && rw_player_home(player)) {
+            status = -1;
+        }
+
+        if (!status && rw_player_set_catchup(player, job->catchup, job->threshold_ms)) {
+            status = -1;
+        }
+
+        // A replay cancelled on shutdown is reported with its partial stats
+        if (!status) {
+            status = rw_player_play(player, job->arena, &stats);
+        }
+
+        if (!status && (job->flags & REPLAYD_FLAG_HOME) && rw_player_home(player)) {
+            status = -1;
+        }
+
+        if (show_info) {
+            printf("job %u, status %d, frames %u, events %u, queued %lu us, "
+                   "duration %lu us, max lateness %lu us, "
+                   "late %u, dropped %u, merged %u\n",
+                   job->id, status, stats.frames, stats.events,
+                   (unsigned long)(queued_ns / 1000),
+                   (unsigned long)(stats.duration_ns / 1000),
+                   (unsigned long)(stats.max_lateness_ns / 1000),
+                   stats.late, stats.dropped, stats.merged);
+        }
+
+        send_reply(job, status, queued_ns, &stats);
+        free_job(job);
+    }
+
+    return NULL;
+}
+
+static int open_socket(void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, SOMAXCONN)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void show_help(void)
+{
+    printf("Usage: ev_replayd <options>\n");
+    printf("Where -h print help\n");
+    printf("      -s socket : The listening socket path\n");
+    printf("                    the default value is: %s\n", socket_path);
+    printf("      -v        : Verbose output, per job statistics\n");
+    printf("                    the default value is false\n");
+    printf("      -T trace  : Binary trace file, see ev_tracedump\n");
+    printf("                    not used by default\n");
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int fd, i, ret, nfds, timeout;
+    uint32_t job_id = 0;
+    pthread_t thread;
+    struct sigaction sa;
+    sigset_t mask, old_mask;
+    struct pollfd fds[MAX_PENDING + 1];
+    struct timespec now;
+    replay_job_t *job;
+    bool listening;
+    long remaining;
+
+    while ((opt = getopt(argc, argv, "h?vs:T:")) != -1) {
+        switch (opt) {
+            case 'h':
+            case '?':
+                show_help();
+                exit(EXIT_SUCCESS);
+            case 's':
+                socket_path = optarg;
+                break;
+            case 'v':
+                show_info = true;
+                break;
+            case 'T':
+                trace_fname = optarg;
+                break;
+            default:
+                show_help();
+                exit(EXIT_SUCCESS);
+        }
+    }
+
+    // The device stays created for the daemon lifetime
+    player = rw_player_open(uinput_node);
+    if (!player) {
+        ON_ERROR("Acquire output devices failed");
+    }
+    sleep(1);
+
+    listen_fd = open_socket();
+    if (listen_fd < 0) {
+        ON_ERROR("Can't create listening socket");
+    }
+
+    // No SA_RESTART, accept has to return on signals
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_handler;
+    if (sigaction(SIGINT, &sa, NULL) || sigaction(SIGTERM, &sa, NULL)) {
+        ON_ERROR("Can't catch SIGINT");
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // Signals are handled by the main thread only
+    sigfillset(&mask);
+    pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+    if (pthread_create(&thread, NULL, player_thread, NULL)) {
+        ON_ERROR("Can't start player thread");
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (trace_fname && rw_trace_start_file(trace_fname)) {
+        ON_ERROR("Can't create trace file");
+    }
+
+    printf("Waiting for replay jobs on %s, use CTRL+C to stop\n", socket_path);
+
+    while (loop) {
+        // Requests not completed in time are dropped
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timeout = -1;
+        for (i = num_pending - 1; i >= 0; i--) {
+            remaining = (pending[i].deadline.tv_sec - now.tv_sec) * 1000 +
+                        (pending[i].deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if (remaining <= 0) {
+                printf("Request of job %u timed out\n", pending[i].id);
+                close(pending[i].fd);
+                remove_pending(i);
+            } else if (timeout < 0 || remaining < timeout) {
+                timeout = remaining;
+            }
+        }
+
+        for (i = 0; i < num_pending; i++) {
+            fds[i].fd = pending[i].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        nfds = num_pending;
+
+        // New connections wait in the listen backlog while all slots are used
+        listening = num_pending < MAX_PENDING;
+        if (listening) {
+            fds[nfds].fd = listen_fd;
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            nfds++;
+        }
+
+        if (poll(fds, nfds, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Can't wait for client requests\n");
+            break;
+        }
+
+        // Backwards, removing a request moves the last one in its slot
+        for (i = num_pending - 1; i >= 0; i--) {
+            if (!fds[i].revents) {
+                continue;
+            }
+
+            ret = read_request(&pending[i]);
+            if (!ret) {
+                continue;
+            }
+
+            job = ret > 0 ? create_job(&pending[i]) : NULL;
+            if (job) {
+                push_job(job);
+            } else {
+                close(pending[i].fd);
+            }
+            remove_pending(i);
+        }
+
+        if (listening && fds[nfds - 1].revents) {
+            fd = accept(listen_fd, NULL, NULL);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (loop) {
+                    printf("Can't accept client connection\n");
+                }
+                break;
+            }
+
+            add_pending(fd, ++job_id);
+        }
+    }
+
+    // Requests still being read on shutdown are dropped
+    while (num_pending) {
+        close(pending[num_pending - 1].fd);
+        remove_pending(num_pending - 1);
+    }
+
+    close_queue();
+    pthread_join(thread, NULL);
+
+    rw_trace_stop();
+
+    close(listen_fd);
+    unlink(socket_path);
+
+    rw_player_close(player);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,89 @@
+/*-
+ * Copyright (c) 2019 Atanas Filipov
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "trace.h"
+
+static const char *in_trace = "/tmp/events.trace";
+
+static void show_help(void)
+{
+    printf("Usage: ev_tracedump <options>\n");
+    printf("Where -h print help\n");
+    printf("      -f input : The binary trace file name\n");
+    printf("                   the default value is: %s\n", in_trace);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    FILE *in_file;
+    rw_trace_header_t header;
+    rw_trace_record_t record;
+
+    while ((opt = getopt(argc, argv, "h?f:")) != -1) {
+        switch (opt) {
+            case 'h':
+            case '?':
+                show_help();
+                exit(EXIT_SUCCESS);
+            case 'f':
+                in_trace = optarg;
+                break;
+            default:
+                show_help();
+                exit(EXIT_SUCCESS);
+        }
+    }
+
+    in_file = fopen(in_trace, "r");
+    if (!in_file) {
+        ON_ERROR("Can't open trace file");
+    }
+
+    if (fread(&header, 1, sizeof(header), in_file) != sizeof(header) ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+        header.version != TRACE_VERSION || header.record_size != sizeof(record)) {
+        printf("Unsupported trace file %s\n", in_trace);
+        exit(EXIT_FAILURE);
+    }
+
+    while (fread(&record, 1, sizeof(record), in_file) == sizeof(record)) {
+        rw_trace_format(stdout, &record);
+    }
+
+    fclose(in_file);
+
+    return EXIT_SUCCESS;
+}
@@ -31,12 +31,13 @@
 #include <string.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include <linux/uinput.h>
 #include "common.h"
 
 #define MOVE_LOOPS 4
 
-static const event_record_t to_lower_left[] = {
+static const rw_record_t to_lower_left[] = {
     {
         .ev_device_id   =  10,
         .event.type     =   2,
@@ -61,7 +62,7 @@ event_source_t* alloc_event_sources(const char *path, uint8_t* num_sources)
 {
     DIR *d;
     struct dirent *dir;
-    static event_source_t *sources;
+    event_source_t *sources = NULL;
     uint8_t count = 0;
 
     d = opendir(path);
@@ -98,83 +99,194 @@ void free_event_sources(event_source_t *ev_source, uint8_t count)
     }
 }
 
+static rw_record_t* load_records(FILE *in_file, uint32_t *num_records)
+{
+    rw_record_t *records = NULL, *grown;
+    uint32_t count = 0, size = 0;
+
+    for (;;) {
+        if (count == size) {
+            size = size ? size * 2 : 1024;
+            grown = realloc(records, sizeof(rw_record_t) * size);
+            if (grown == NULL) {
+                free(records);
+                return NULL;
+            }
+            records = grown;
+        }
+
+        if (fread(&records[count], 1, sizeof(rw_record_t), in_file) != sizeof(rw_record_t)) {
+            if (feof(in_file)) {
+                break;
+            }
+            free(records);
+            return NULL;
+        }
+        count++;
+    }
+
+    *num_records = count;
+
+    return records;
+}
+
+rw_arena_t* rw_arena_load(FILE *in_file)
+{
+    rw_record_t *records;
+    rw_arena_t *arena;
+    uint32_t count;
+
+    records = load_records(in_file, &count);
+    if (records == NULL) {
+        return NULL;
+    }
+
+    arena = rw_arena_alloc(records, count);
+
+    free(records);
+
+    return arena;
+}
+
+rw_arena_t* rw_arena_alloc(const rw_record_t *records, uint32_t count)
+{
+    rw_arena_t *arena;
+    rw_frame_t *frame = NULL;
+    struct timeval start, offset;
+
+    if (records == NULL && count) {
+        return NULL;
+    }
+
+    // Arena header, events and frames (at most one per event) in one block
+    arena = malloc(sizeof(rw_arena_t) + (sizeof(struct input_event) +
+                   sizeof(rw_frame_t)) * count);
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    arena->events = (struct input_event *)(arena + 1);
+    arena->frames = (rw_frame_t *)(arena->events + count);
+    arena->num_events = count;
+    arena->num_frames = 0;
+
+    // An empty recording gives an arena without frames
+    if (count) {
+        start = records[0].event.time;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        const rw_record_t *rec = &records[i];
+        const struct input_event *head;
+
+        // Events of one frame share the device and the kernel timestamp
+        if (frame != NULL) {
+            head = &arena->events[frame->first];
+            if (frame->ev_device_id != rec->ev_device_id ||
+                timercmp(&head->time, &rec->event.time, !=)) {
+                frame = NULL;
+            }
+        }
+
+        if (frame == NULL) {
+            frame = &arena->frames[arena->num_frames++];
+            frame->first = i;
+            frame->count = 0;
+            frame->ev_device_id = rec->ev_device_id;
+
+            // Keep the deadlines monotonic, even for out of order records
+            timersub(&rec->event.time, &start, &offset);
+            if (offset.tv_sec < 0) {
+                frame->deadline_ns = 0;
+            } else {
+                frame->deadline_ns = (uint64_t)offset.tv_sec * 1000000000 +
+                                     (uint64_t)offset.tv_usec * 1000;
+            }
+
+            if (arena->num_frames > 1 && frame->deadline_ns < (frame - 1)->deadline_ns) {
+                frame->deadline_ns = (frame - 1)->deadline_ns;
+            }
+        }
+
+        arena->events[i] = rec->event;
+        frame->count++;
+
+        if (rec->event.type == EV_SYN && rec->event.code == SYN_REPORT) {
+            frame = NULL;
+        }
+    }
+
+    return arena;
+}
+
+void rw_arena_free(rw_arena_t *arena)
+{
+    free(arena);
+}
+
 int acquire_uinput(int fd)
 {
     struct uinput_user_dev uidev;
 
     // Enable Mouse events simulation
     if (ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0) {
-        printf("Cannot enable button events\n");
         return -1;
     }
 
     if (ioctl(fd, UI_SET_KEYBIT, BTN_LEFT) < 0) {
-        printf("Can't setup button event source\n");
         return -1;
     }
 
     if (ioctl(fd, UI_SET_KEYBIT, BTN_RIGHT) < 0) {
-        printf("Can't setup event sources %d\n", __LINE__);
         return -1;
     }
 
     if (ioctl(fd, UI_SET_KEYBIT, BTN_MIDDLE) < 0) {
-        printf("Can't setup event sources %d\n", __LINE__);
         return -1;
     }
 
     if (ioctl(fd, UI_SET_KEYBIT, BTN_WHEEL) < 0) {
-        printf("Can't setup event sources %d\n", __LINE__);
         return -1;
     }
 
     if (ioctl(fd, UI_SET_KEYBIT, BTN_GEAR_DOWN) < 0) {
-        printf("Can't setup event sources %d\n", __LINE__);
         return -1;
     }
 
     if (ioctl(fd, UI_SET_KEYBIT, BTN_GEAR_UP) < 0) {
-        printf("Can't setup event sources %d\n", __LINE__);
         return -1;
     }
 
     if (ioctl(fd, UI_SET_EVBIT, EV_REL) < 0) {
-        printf("Can't enable relative events\n");
         return -1;
     }
 
     if (ioctl(fd, UI_SET_RELBIT, REL_X) < 0) {
-        printf("Cannot setup event sources %d\n", __LINE__);
         return -1;
     }
 
     if (ioctl(fd, UI_SET_RELBIT, REL_Y) < 0) {
-        printf("Can't setup event sources %d\n", __LINE__);
         return -1;
     }
 
     // Enable Keyboard events simulation
     if (ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0) {
-        printf("Can't enable key events\n");
         return -1;
     }
 
     for (uint16_t i = KEY_ESC; i < KEY_MAX; i++) {
         if (ioctl(fd, UI_SET_KEYBIT, i) < 0) {
-            printf("Can't setup event sources %d\n", __LINE__);
             return -1;
         }
     }
 
     // Enable Touch events simulation
     if (ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0) {
-        printf("Cannot enable touch events\n");
         return -1;
     }
 
     for (uint16_t i = ABS_X; i < ABS_MAX; i++) {
         if (ioctl(fd, UI_SET_ABSBIT, i) < 0) {
-            printf("Can't setup event sources %d\n", __LINE__);
             return -1;
         }
     }
@@ -187,12 +299,10 @@ int acquire_uinput(int fd)
     uidev.id.version = 1;
 
     if (write(fd, &uidev, sizeof(uidev)) < 0) {
-        printf("Write to device failed\n");
         return -1;
     }
 
     if (ioctl(fd, UI_DEV_CREATE) < 0) {
-        printf("IOC Device create failed\n");
         return -1;
     }
 
@@ -202,7 +312,6 @@ int acquire_uinput(int fd)
 int release_uinput(int fd)
 {
     if (ioctl(fd, UI_DEV_DESTROY) < 0) {
-        printf("IOC Device destroy failed\n");
         return -1;
     }
 
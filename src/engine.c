@@ -0,0 +1,689 @@
+/*-
+ * Copyright (c) 2019 Atanas Filipov
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include "common.h"
+#include "trace.h"
+
+#define DEFAULT_INPUTS  "/dev/input"
+#define DEFAULT_UINPUT  "/dev/uinput"
+
+// Events read from a source node with a single read call
+#define READ_BATCH      64
+
+// Longest sleep of the player, before a cancel request is checked again
+#define SLEEP_SLICE_NS  100000000L
+
+#define NSEC_PER_SEC    1000000000L
+#define NSEC_PER_MSEC   1000000L
+
+struct rw_capture {
+    event_source_t *sources;
+    struct pollfd  *fds;        // Source nodes followed by the wake pipe
+    uint8_t         count;
+    int             wake[2];
+    volatile sig_atomic_t cancel;
+
+    // Background capture state
+    pthread_t       thread;
+    bool            running;
+    rw_capture_cb   sink;
+    rw_capture_cb   cb;
+    void           *ctx;
+    int             result;
+    size_t          delivered;
+
+    // Caller supplied buffer
+    rw_record_t    *buffer;
+    size_t          size;
+};
+
+struct rw_player {
+    int             fd;
+    volatile sig_atomic_t cancel;
+    rw_frame_cb     frame_cb;
+    void           *frame_ctx;
+    rw_catchup_t    catchup;
+    int64_t         threshold_ns;
+};
+
+static void timespec_add_ns(struct timespec *ts, uint64_t ns)
+{
+    ts->tv_sec += ns / NSEC_PER_SEC;
+    ts->tv_nsec += ns % NSEC_PER_SEC;
+    if (ts->tv_nsec >= NSEC_PER_SEC) {
+        ts->tv_sec++;
+        ts->tv_nsec -= NSEC_PER_SEC;
+    }
+}
+
+static int64_t timespec_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+    return (int64_t)(a->tv_sec - b->tv_sec) * NSEC_PER_SEC + (a->tv_nsec - b->tv_nsec);
+}
+
+rw_capture_t* rw_capture_open(const char *path)
+{
+    char buffer[PATH_MAX];
+    rw_capture_t *cap;
+    int err;
+
+    if (path == NULL) {
+        path = DEFAULT_INPUTS;
+    }
+
+    cap = calloc(1, sizeof(*cap));
+    if (cap == NULL) {
+        return NULL;
+    }
+
+    cap->wake[0] = cap->wake[1] = -1;
+
+    errno = 0;
+    cap->sources = alloc_event_sources(path, &cap->count);
+    if (cap->sources == NULL) {
+        // An empty folder has no error of its own
+        if (!errno) {
+            errno = ENODEV;
+        }
+        goto error;
+    }
+
+    cap->fds = calloc(cap->count + 1, sizeof(struct pollfd));
+    if (cap->fds == NULL) {
+        goto error;
+    }
+
+    for (uint8_t i = 0; i < cap->count; i++) {
+        cap->fds[i].fd = -1;
+    }
+
+    for (uint8_t i = 0; i < cap->count; i++) {
+        snprintf(buffer, sizeof(buffer), "%s/%s", path, cap->sources[i].ev_device_name);
+        cap->fds[i].events = POLLIN;
+        cap->fds[i].fd = open(buffer, O_RDONLY | O_NDELAY);
+        if (cap->fds[i].fd < 0) {
+            goto error;
+        }
+    }
+
+    if (pipe(cap->wake)) {
+        goto error;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (fcntl(cap->wake[i], F_SETFL, O_NONBLOCK) < 0) {
+            goto error;
+        }
+    }
+
+    cap->fds[cap->count].events = POLLIN;
+    cap->fds[cap->count].fd = cap->wake[0];
+
+    return cap;
+
+error:
+    // Report the failure reason, not the one of the cleanup
+    err = errno;
+    rw_capture_close(cap);
+    errno = err;
+    return NULL;
+}
+
+void rw_capture_close(rw_capture_t *cap)
+{
+    if (cap == NULL) {
+        return;
+    }
+
+    if (cap->running) {
+        rw_capture_stop(cap, NULL);
+    }
+
+    if (cap->fds != NULL) {
+        for (uint8_t i = 0; i < cap->count; i++) {
+            if (cap->fds[i].fd >= 0) {
+                close(cap->fds[i].fd);
+            }
+        }
+        free(cap->fds);
+    }
+
+    if (cap->wake[0] >= 0) {
+        close(cap->wake[0]);
+        close(cap->wake[1]);
+    }
+
+    if (cap->sources != NULL) {
+        free_event_sources(cap->sources, cap->count);
+        free(cap->sources);
+    }
+
+    free(cap);
+}
+
+void rw_capture_cancel(rw_capture_t *cap)
+{
+    const char c = 0;
+
+    cap->cancel = 1;
+    if (write(cap->wake[1], &c, sizeof(c)) < 0) {
+        // The pipe is already full, the capture loop gets woken anyway
+    }
+}
+
+static void drain_wake(rw_capture_t *cap)
+{
+    char buffer[16];
+
+    while (read(cap->wake[0], buffer, sizeof(buffer)) > 0);
+    cap->cancel = 0;
+}
+
+int rw_capture_run(rw_capture_t *cap, rw_capture_cb cb, void *ctx)
+{
+    struct input_event events[READ_BATCH];
+    rw_record_t record;
+    ssize_t size;
+    int result = 0;
+
+    while (!cap->cancel) {
+
+        if (poll(cap->fds, cap->count + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            result = -1;
+            break;
+        }
+
+        if (cap->fds[cap->count].revents & POLLIN) {
+            break;
+        }
+
+        for (uint8_t i = 0; i < cap->count && !result; i++) {
+            if (!(cap->fds[i].revents & POLLIN)) {
+                continue;
+            }
+
+            // Data available
+            size = read(cap->fds[i].fd, events, sizeof(events));
+            if (size < (ssize_t)sizeof(events[0])) {
+#ifdef DEBUG
+                printf("Unexpected event size %zd\n", size);
+#endif
+                continue;
+            }
+
+            for (size_t e = 0; e < size / sizeof(events[0]) && !result; e++) {
+                memset(&record, 0, sizeof(record));
+                record.ev_device_id = i;
+                record.event = events[e];
+                rw_trace_point(TRACE_CAPTURE, i, &record.event,
+                               (int64_t)events[e].time.tv_sec * 1000000 + events[e].time.tv_usec);
+                result = cb(&record, ctx);
+            }
+        }
+
+        if (result) {
+            break;
+        }
+    }
+
+    drain_wake(cap);
+
+    return result < 0 ? -1 : 0;
+}
+
+static void* capture_thread(void *arg)
+{
+    rw_capture_t *cap = arg;
+
+    cap->result = rw_capture_run(cap, cap->sink, cap);
+
+    return NULL;
+}
+
+static int sink_callback(const rw_record_t *record, void *ctx)
+{
+    rw_capture_t *cap = ctx;
+
+    cap->delivered++;
+
+    return cap->cb(record, cap->ctx);
+}
+
+static int sink_buffer(const rw_record_t *record, void *ctx)
+{
+    rw_capture_t *cap = ctx;
+
+    cap->buffer[cap->delivered++] = *record;
+
+    // Stop when the caller buffer is full
+    return cap->delivered == cap->size;
+}
+
+static int capture_spawn(rw_capture_t *cap, rw_capture_cb sink)
+{
+    sigset_t all, old;
+    int ret;
+
+    if (cap->running) {
+        return -1;
+    }
+
+    cap->sink = sink;
+    cap->delivered = 0;
+    cap->result = 0;
+
+    // Signals are left to the caller threads
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&cap->thread, NULL, capture_thread, cap);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret) {
+        return -1;
+    }
+
+    cap->running = true;
+
+    return 0;
+}
+
+int rw_capture_start(rw_capture_t *cap, rw_capture_cb cb, void *ctx)
+{
+    if (cb == NULL) {
+        return -1;
+    }
+
+    cap->cb = cb;
+    cap->ctx = ctx;
+
+    return capture_spawn(cap, sink_callback);
+}
+
+int rw_capture_start_buffer(rw_capture_t *cap, rw_record_t *buffer, size_t size)
+{
+    if (buffer == NULL || !size) {
+        return -1;
+    }
+
+    cap->buffer = buffer;
+    cap->size = size;
+
+    return capture_spawn(cap, sink_buffer);
+}
+
+int rw_capture_stop(rw_capture_t *cap, size_t *count)
+{
+    if (!cap->running) {
+        return -1;
+    }
+
+    rw_capture_cancel(cap);
+    pthread_join(cap->thread, NULL);
+    cap->running = false;
+
+    // A capture stopped by its sink leaves the cancel request pending
+    drain_wake(cap);
+
+    if (count != NULL) {
+        *count = cap->delivered;
+    }
+
+    return cap->result;
+}
+
+rw_player_t* rw_player_open(const char *node)
+{
+    rw_player_t *player;
+    int err;
+
+    if (node == NULL) {
+        node = DEFAULT_UINPUT;
+    }
+
+    player = calloc(1, sizeof(*player));
+    if (player == NULL) {
+        return NULL;
+    }
+
+    player->catchup = RW_CATCHUP_BURST;
+    player->threshold_ns = RW_LATE_THRESHOLD_MS * NSEC_PER_MSEC;
+
+    player->fd = open(node, O_WRONLY | O_NONBLOCK);
+    if (player->fd < 0) {
+        free(player);
+        return NULL;
+    }
+
+    if (acquire_uinput(player->fd)) {
+        err = errno;
+        close(player->fd);
+        free(player);
+        errno = err;
+        return NULL;
+    }
+
+    return player;
+}
+
+void rw_player_close(rw_player_t *player)
+{
+    if (player == NULL) {
+        return;
+    }
+
+    release_uinput(player->fd);
+    free(player);
+}
+
+void rw_player_set_frame_cb(rw_player_t *player, rw_frame_cb cb, void *ctx)
+{
+    player->frame_cb = cb;
+    player->frame_ctx = ctx;
+}
+
+int rw_player_set_catchup(rw_player_t *player, rw_catchup_t policy, uint32_t threshold_ms)
+{
+    // A zero threshold would drop or merge every frame which is not exactly on time
+    if (policy > RW_CATCHUP_REBASE ||
+        (!threshold_ms && (policy == RW_CATCHUP_DROP || policy == RW_CATCHUP_COALESCE))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    player->catchup = policy;
+    player->threshold_ns = (int64_t)threshold_ms * NSEC_PER_MSEC;
+
+    return 0;
+}
+
+void rw_player_cancel(rw_player_t *player)
+{
+    player->cancel = 1;
+}
+
+int rw_player_inject(rw_player_t *player, const struct input_event *events, size_t count)
+{
+    const size_t size = sizeof(*events) * count;
+
+    if (write(player->fd, events, size) != (ssize_t)size) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int rw_player_home(rw_player_t *player)
+{
+    return set_position(player->fd);
+}
+
+static void sleep_until(rw_player_t *player, const struct timespec *deadline)
+{
+    struct timespec now, wake;
+
+    while (!player->cancel) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (timespec_diff_ns(deadline, &now) <= 0) {
+            return;
+        }
+
+        // Long gaps are slept in slices, to notice a cancel from other threads
+        wake = now;
+        timespec_add_ns(&wake, SLEEP_SLICE_NS);
+        if (timespec_diff_ns(deadline, &wake) < 0) {
+            wake = *deadline;
+        }
+
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+    }
+}
+
+// Frames which only move the pointer, nothing is lost when they are skipped
+static bool is_motion_frame(const rw_frame_t *frame, const struct input_event *events)
+{
+    for (uint32_t i = 0; i < frame->count; i++) {
+        switch (events[i].type) {
+            case EV_SYN:
+            case EV_REL:
+            case EV_MSC:
+                break;
+            case EV_ABS:
+                // ABS_MT_* axes select slots and track contacts, never skip them
+                if (events[i].code >= ABS_MT_SLOT) {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static bool is_rel_frame(const rw_frame_t *frame, const struct input_event *events)
+{
+    for (uint32_t i = 0; i < frame->count; i++) {
+        if (events[i].type != EV_REL && events[i].type != EV_SYN) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Sum the REL axes of frame "f" and of the following REL frames of the same
+ * device which are also late, due longer than "threshold_ns". Returns the
+ * index of the last merged frame.
+ */
+static uint32_t coalesce_frames(const rw_arena_t *arena, uint32_t f,
+                                const struct timespec *base, const struct timespec *now,
+                                int64_t threshold_ns, rw_frame_t *merged,
+                                struct input_event *events)
+{
+    const rw_frame_t *first = &arena->frames[f];
+    int32_t values[REL_CNT] = { 0 };
+    bool present[REL_CNT] = { false };
+    struct timespec deadline;
+    uint32_t last = f;
+
+    for (uint32_t n = f; n < arena->num_frames; n++) {
+        const rw_frame_t *frame = &arena->frames[n];
+        const struct input_event *in = &arena->events[frame->first];
+
+        if (n != f) {
+            deadline = *base;
+            timespec_add_ns(&deadline, frame->deadline_ns);
+            if (frame->ev_device_id != first->ev_device_id ||
+                timespec_diff_ns(now, &deadline) <= threshold_ns || !is_rel_frame(frame, in)) {
+                break;
+            }
+        }
+
+        for (uint32_t i = 0; i < frame->count; i++) {
+            if (in[i].type == EV_REL && in[i].code < REL_CNT) {
+                values[in[i].code] += in[i].value;
+                present[in[i].code] = true;
+            }
+        }
+        last = n;
+    }
+
+    *merged = *first;
+    merged->first = 0;
+    merged->count = 0;
+
+    for (uint16_t code = 0; code < REL_CNT; code++) {
+        if (present[code]) {
+            memset(&events[merged->count], 0, sizeof(events[0]));
+            events[merged->count].type = EV_REL;
+            events[merged->count].code = code;
+            events[merged->count].value = values[code];
+            merged->count++;
+        }
+    }
+
+    memset(&events[merged->count], 0, sizeof(events[0]));
+    events[merged->count].type = EV_SYN;
+    events[merged->count].code = SYN_REPORT;
+    merged->count++;
+
+    return last;
+}
+
+int rw_player_play(rw_player_t *player, const rw_arena_t *arena, rw_play_stats_t *stats)
+{
+    struct timespec start, base, deadline, now;
+    struct input_event merged_events[REL_CNT + 1];
+    rw_frame_t merged;
+    struct input_event info;
+    rw_play_stats_t local;
+    int64_t late;
+    int result = 0;
+
+    if (stats == NULL) {
+        stats = &local;
+    }
+    memset(stats, 0, sizeof(*stats));
+    memset(&info, 0, sizeof(info));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    base = start;
+
+    for (uint32_t f = 0; f < arena->num_frames; f++) {
+        const rw_frame_t *frame = &arena->frames[f];
+        const struct input_event *events = &arena->events[frame->first];
+
+        deadline = base;
+        timespec_add_ns(&deadline, frame->deadline_ns);
+        sleep_until(player, &deadline);
+        if (player->cancel) {
+            result = RW_PLAY_CANCELLED;
+            break;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        late = timespec_diff_ns(&now, &deadline);
+        if (late > 0 && (uint64_t)late > stats->max_lateness_ns) {
+            stats->max_lateness_ns = late;
+        }
+
+        if (late > player->threshold_ns) {
+            stats->late++;
+
+            switch (player->catchup) {
+                case RW_CATCHUP_DROP:
+                    if (is_motion_frame(frame, events)) {
+                        info.value = frame->count;
+                        rw_trace_point(TRACE_DROP, frame->ev_device_id, &info, late);
+                        stats->dropped++;
+                        continue;
+                    }
+                    break;
+                case RW_CATCHUP_COALESCE:
+                    if (is_rel_frame(frame, events)) {
+                        const uint32_t last = coalesce_frames(arena, f, &base, &now,
+                                                              player->threshold_ns,
+                                                              &merged, merged_events);
+                        info.value = last - f + 1;
+                        rw_trace_point(TRACE_MERGE, frame->ev_device_id, &info, late);
+                        // The folded frames are late as well, as with the drop policy
+                        stats->late += last - f;
+                        stats->merged += last - f;
+                        f = last;
+                        frame = &merged;
+                        events = merged_events;
+                    }
+                    break;
+                case RW_CATCHUP_REBASE:
+                    // The following frames keep their spacing to this one
+                    timespec_add_ns(&base, late);
+                    stats->rebased_ns += late;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        // One write per frame, uinput accepts the whole batch at once
+        if (rw_player_inject(player, events, frame->count)) {
+            result = -1;
+            break;
+        }
+
+        for (uint32_t i = 0; i < frame->count; i++) {
+            rw_trace_point(TRACE_REPLAY, frame->ev_device_id, &events[i], late);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        stats->frames++;
+        stats->events += frame->count;
+        stats->duration_ns = timespec_diff_ns(&now, &start);
+
+        if (player->frame_cb != NULL) {
+            player->frame_cb(frame, events, player->frame_ctx);
+        }
+    }
+
+    player->cancel = 0;
+
+    return result;
+}
+
+int rw_player_play_records(rw_player_t *player, const rw_record_t *records,
+                           uint32_t count, rw_play_stats_t *stats)
+{
+    rw_arena_t *arena;
+    int result;
+
+    arena = rw_arena_alloc(records, count);
+    if (arena == NULL) {
+        return -1;
+    }
+
+    result = rw_player_play(player, arena, stats);
+
+    rw_arena_free(arena);
+
+    return result;
+}
@@ -0,0 +1,382 @@
+/*-
+ * Copyright (c) 2019 Atanas Filipov
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include "trace.h"
+
+// Default records per thread ring, a burst replay of a long recording fits
+#define RING_SIZE       65536
+
+// Consumer poll period
+#define DRAIN_PERIOD_NS 10000000L
+
+// Single producer, single consumer ring of one traced thread
+struct trace_ring {
+    struct trace_ring *next;
+    uint32_t        head;       // Written by the producer thread
+    uint32_t        tail;       // Written by the consumer thread
+    uint32_t        lost;       // Records dropped on overflow
+    uint32_t        reported;   // Lost records already reported
+    uint32_t        size;       // Power of two
+    uint32_t        thread;
+    int             dead;       // Set when the producer thread exits
+    rw_trace_record_t  records[];
+};
+typedef struct trace_ring trace_ring_t;
+
+int rw_trace_enabled = 0;
+
+static __thread trace_ring_t *thread_ring;
+
+// Rings of exited threads are freed by the consumer after the last drain
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *rings;
+static uint32_t num_rings;
+static uint32_t ring_size = RING_SIZE;
+
+static pthread_t consumer;
+static volatile bool consumer_run;
+static FILE *trace_out;
+static bool trace_binary;
+static bool trace_owned;
+
+static const char *kind_names[] = {
+    [TRACE_CAPTURE] = "capture",
+    [TRACE_REPLAY]  = "replay",
+    [TRACE_DROP]    = "drop",
+    [TRACE_MERGE]   = "merge",
+    [TRACE_LOST]    = "lost",
+};
+
+static void release_ring(void *arg)
+{
+    trace_ring_t *ring = arg;
+
+    // A later trace point of this thread allocates a new ring
+    thread_ring = NULL;
+    __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void create_ring_key(void)
+{
+    pthread_key_create(&ring_key, release_ring);
+}
+
+static trace_ring_t* alloc_ring(void)
+{
+    trace_ring_t *ring;
+    uint32_t size = __atomic_load_n(&ring_size, __ATOMIC_RELAXED);
+
+    pthread_once(&ring_once, create_ring_key);
+
+    ring = calloc(1, sizeof(*ring) + sizeof(rw_trace_record_t) * size);
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->size = size;
+    pthread_setspecific(ring_key, ring);
+
+    pthread_mutex_lock(&rings_lock);
+    ring->thread = num_rings++;
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+
+    return ring;
+}
+
+void rw_trace_set_ring_size(uint32_t records)
+{
+    uint32_t size = 1;
+
+    while (size < records && size < (1U << 24)) {
+        size <<= 1;
+    }
+
+    __atomic_store_n(&ring_size, size, __ATOMIC_RELAXED);
+}
+
+void rw_trace_emit(uint8_t kind, uint8_t ev_device_id, const struct input_event *event,
+                   int64_t arg)
+{
+    trace_ring_t *ring = thread_ring;
+    rw_trace_record_t *record;
+    struct timespec now;
+    uint32_t head;
+
+    if (ring == NULL) {
+        ring = thread_ring = alloc_ring();
+        if (ring == NULL) {
+            return;
+        }
+    }
+
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ring->size) {
+        __atomic_store_n(&ring->lost, ring->lost + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    record = &ring->records[head & (ring->size - 1)];
+    record->ts_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->arg = arg;
+    record->kind = kind;
+    record->ev_device_id = ev_device_id;
+    record->thread = ring->thread;
+    record->reserved = 0;
+    if (event != NULL) {
+        record->type = event->type;
+        record->code = event->code;
+        record->value = event->value;
+    } else {
+        record->type = 0;
+        record->code = 0;
+        record->value = 0;
+    }
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void rw_trace_format(FILE *out, const rw_trace_record_t *record)
+{
+    const char *kind = "unknown";
+
+    if (record->kind < sizeof(kind_names) / sizeof(kind_names[0]) &&
+        kind_names[record->kind] != NULL) {
+        kind = kind_names[record->kind];
+    }
+
+    fprintf(out, "%lu.%09lu [%u] %-7s ",
+            (unsigned long)(record->ts_ns / 1000000000ULL),
+            (unsigned long)(record->ts_ns % 1000000000ULL), record->thread, kind);
+
+    switch (record->kind) {
+        case TRACE_CAPTURE:
+            fprintf(out, "input %d, time %ld.%06ld, type %d, code %d, value %d\n",
+                    record->ev_device_id, (long)(record->arg / 1000000),
+                    (long)(record->arg % 1000000), record->type, record->code,
+                    record->value);
+            break;
+        case TRACE_REPLAY:
+            fprintf(out, "input %d, late %ld us, type %d, code %d, value %d\n",
+                    record->ev_device_id, (long)(record->arg / 1000),
+                    record->type, record->code, record->value);
+            break;
+        case TRACE_DROP:
+            fprintf(out, "input %d, late %ld us, events %d\n",
+                    record->ev_device_id, (long)(record->arg / 1000), record->value);
+            break;
+        case TRACE_MERGE:
+            fprintf(out, "input %d, late %ld us, frames %d\n",
+                    record->ev_device_id, (long)(record->arg / 1000), record->value);
+            break;
+        case TRACE_LOST:
+            fprintf(out, "records %d\n", record->value);
+            break;
+        default:
+            fprintf(out, "\n");
+            break;
+    }
+}
+
+static void write_record(const rw_trace_record_t *record)
+{
+    if (trace_binary) {
+        if (fwrite(record, 1, sizeof(*record), trace_out) != sizeof(*record)) {
+            // Nothing to do, the trace is best effort
+        }
+    } else {
+        rw_trace_format(trace_out, record);
+    }
+}
+
+static void unlink_ring(trace_ring_t *ring)
+{
+    trace_ring_t **link;
+
+    pthread_mutex_lock(&rings_lock);
+    for (link = &rings; *link != NULL; link = &(*link)->next) {
+        if (*link == ring) {
+            *link = ring->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+}
+
+static void drain_rings(void)
+{
+    rw_trace_record_t lost;
+    trace_ring_t *ring, *next;
+    struct timespec now;
+    uint32_t head, tail, count;
+    int dead;
+
+    pthread_mutex_lock(&rings_lock);
+    ring = rings;
+    pthread_mutex_unlock(&rings_lock);
+
+    // New rings are only added at the list head, only this thread unlinks
+    for (; ring != NULL; ring = next) {
+        next = ring->next;
+
+        // Checked first, all records of a dead ring are already published
+        dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (tail = ring->tail; tail != head; tail++) {
+            write_record(&ring->records[tail & (ring->size - 1)]);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        count = __atomic_load_n(&ring->lost, __ATOMIC_RELAXED);
+        if (count != ring->reported) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            memset(&lost, 0, sizeof(lost));
+            lost.ts_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+            lost.kind = TRACE_LOST;
+            lost.thread = ring->thread;
+            lost.value = count - ring->reported;
+            write_record(&lost);
+            ring->reported = count;
+        }
+
+        if (dead) {
+            unlink_ring(ring);
+            free(ring);
+        }
+    }
+
+    fflush(trace_out);
+}
+
+static void* consumer_thread(void *arg)
+{
+    const struct timespec period = { .tv_sec = 0, .tv_nsec = DRAIN_PERIOD_NS };
+
+    (void)arg;
+
+    while (consumer_run) {
+        drain_rings();
+        nanosleep(&period, NULL);
+    }
+
+    drain_rings();
+
+    return NULL;
+}
+
+int rw_trace_start(FILE *out, bool binary)
+{
+    rw_trace_header_t header;
+    sigset_t all, old;
+    int ret;
+
+    if (consumer_run || out == NULL) {
+        return -1;
+    }
+
+    trace_out = out;
+    trace_binary = binary;
+
+    if (binary) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+        header.version = TRACE_VERSION;
+        header.record_size = sizeof(rw_trace_record_t);
+        if (fwrite(&header, 1, sizeof(header), out) != sizeof(header)) {
+            return -1;
+        }
+    }
+
+    consumer_run = true;
+
+    // Signals are left to the traced threads
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&consumer, NULL, consumer_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret) {
+        consumer_run = false;
+        return -1;
+    }
+
+    __atomic_store_n(&rw_trace_enabled, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+int rw_trace_start_file(const char *path)
+{
+    FILE *out;
+
+    out = fopen(path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+
+    if (rw_trace_start(out, true)) {
+        fclose(out);
+        return -1;
+    }
+
+    trace_owned = true;
+
+    return 0;
+}
+
+void rw_trace_stop(void)
+{
+    if (!consumer_run) {
+        return;
+    }
+
+    __atomic_store_n(&rw_trace_enabled, 0, __ATOMIC_RELAXED);
+
+    consumer_run = false;
+    pthread_join(consumer, NULL);
+
+    if (trace_owned) {
+        fclose(trace_out);
+        trace_owned = false;
+    } else {
+        fflush(trace_out);
+    }
+}